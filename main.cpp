@@ -1,19 +1,119 @@
 #include "src/commonheader.h"
 
 #include "src/camera.h"
+#include "src/chunked_scene.h"
 #include "src/color.h"
+#include "src/constant_medium.h"
+#include "src/grid_medium.h"
 #include "src/hittable_list.h"
 #include "src/material.h"
 #include "src/sphere.h"
+#include "src/texture.h"
+#include "src/texture_cache.h"
+#include "src/tiled_texture.h"
 #include "src/vec3.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
 #include <memory>
+#include <string>
 
 
-int main() {
+int run(int argc, char *argv[]) {
+  // Options:
+  //   --texture <file>      Ground texture (.ppm is converted to a tiled .rtx)
+  //   --texture-cache-mb <n> Memory cap for resident texture tiles
+  //   --out-of-core <file>  Stream the scene from a chunked file on disk
+  //   --scene-memory-mb <n> Memory budget for out-of-core chunks and rays
+  //   --scene-extent <n>    Half width of the random sphere field (default 11)
+  //   --time-budget <sec>   Render progressively until the deadline instead
+  //                         of to a fixed sample count
+  //   --smoke               Fill the scene with haze and procedural smoke
+  //   --smoke-file <file>   Like --smoke, with smoke from a voxel file
+  //   --smoke-block <n>     Voxels per side of a smoke majorant block (8)
+  //   --width <n>           Image width (default 1200)
+  //   --spp <n>             Samples per pixel (default 500)
+  //   --preview <file>      Interactive mode: re-render whenever the camera
+  //                         file changes (created if missing)
+  //   --frame <file>        Where preview frames are published (preview.ppm)
+  std::string ground_texture;
+  size_t texture_cache_mb = 256;
+  std::string out_of_core_file;
+  size_t scene_memory_mb = 512;
+  int scene_extent = 11;
+  double time_budget = 0;
+  bool smoke = false;
+  std::string smoke_file;
+  int smoke_block = 8;
+  int image_width = 1200;
+  int samples_per_pixel = 500;
+  std::string preview_file;
+  std::string frame_file = "preview.ppm";
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--texture") && i + 1 < argc)
+      ground_texture = argv[++i];
+    else if (!strcmp(argv[i], "--texture-cache-mb") && i + 1 < argc)
+      texture_cache_mb = std::stoul(argv[++i]);
+    else if (!strcmp(argv[i], "--out-of-core") && i + 1 < argc)
+      out_of_core_file = argv[++i];
+    else if (!strcmp(argv[i], "--scene-memory-mb") && i + 1 < argc)
+      scene_memory_mb = std::stoul(argv[++i]);
+    else if (!strcmp(argv[i], "--scene-extent") && i + 1 < argc)
+      scene_extent = std::stoi(argv[++i]);
+    else if (!strcmp(argv[i], "--time-budget") && i + 1 < argc)
+      time_budget = std::stod(argv[++i]);
+    else if (!strcmp(argv[i], "--smoke"))
+      smoke = true;
+    else if (!strcmp(argv[i], "--smoke-file") && i + 1 < argc) {
+      smoke = true;
+      smoke_file = argv[++i];
+    } else if (!strcmp(argv[i], "--smoke-block") && i + 1 < argc)
+      smoke_block = std::max(1, std::stoi(argv[++i]));
+    else if (!strcmp(argv[i], "--width") && i + 1 < argc)
+      image_width = std::stoi(argv[++i]);
+    else if (!strcmp(argv[i], "--spp") && i + 1 < argc)
+      samples_per_pixel = std::stoi(argv[++i]);
+    else if (!strcmp(argv[i], "--preview") && i + 1 < argc)
+      preview_file = argv[++i];
+    else if (!strcmp(argv[i], "--frame") && i + 1 < argc)
+      frame_file = argv[++i];
+  }
+
+  auto textures = make_shared<texture_cache>(texture_cache_mb * 1024 * 1024);
+
   // World
   hittable_list world;
 
+  // Out-of-core scenes are binned into cells of 2x2 units or larger, which
+  // are grouped into chunks of up to 1 MiB (less for small memory budgets).
+  // While building, the bin table gets a sixteenth of the memory budget and
+  // the record buffer a quarter.
+  shared_ptr<chunked_scene_builder> builder;
+  if (!out_of_core_file.empty()) {
+    size_t budget = scene_memory_mb * 1024 * 1024;
+    int max_cells = static_cast<int>(
+        std::sqrt(budget / 16 / chunked_scene_builder::bin_bytes()));
+    int cells = std::clamp(scene_extent, 1, std::max(1, max_cells));
+    builder = make_shared<chunked_scene_builder>(
+        out_of_core_file,
+        aabb(point3(-scene_extent, 0, -scene_extent),
+             point3(scene_extent, 1, scene_extent)),
+        cells, 1, cells, std::min<size_t>(1024 * 1024, budget / 8),
+        std::min<size_t>(16 * 1024 * 1024, budget / 4));
+  }
+
+  auto add_sphere = [&](const point3 &center, double radius,
+                        shared_ptr<material> mat) {
+    if (builder)
+      builder->add(center, radius, mat);
+    else
+      world.add(make_shared<sphere>(center, radius, mat));
+  };
+
   // auto R = cos(pi/4);
 
   // auto material_left = make_sharred<lambertian>(color(0,0,1));
@@ -38,11 +138,29 @@ int main() {
   // world.add(make_shared<sphere>(point3(1.0, 0.0, -1.0), 0.5, material_left));
   // // world.add(make_shared<sphere>(point3(1.0, 0.0, -1.0), -0.3, material_left));
 
-  auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-  world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+  shared_ptr<material> ground_material;
+  if (ground_texture.empty()) {
+    ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+  } else {
+    auto suffix = std::string(".ppm");
+    if (ground_texture.size() > suffix.size() &&
+        ground_texture.compare(ground_texture.size() - suffix.size(),
+                               suffix.size(), suffix) == 0) {
+      // Converted once, and again only when the image is newer
+      auto tiled = ground_texture.substr(0, ground_texture.size() - 4) + ".rtx";
+      if (tiled_texture_is_stale(ground_texture, tiled)) {
+        std::clog << "Converting " << ground_texture << " to " << tiled << '\n';
+        convert_ppm_to_tiled(ground_texture, tiled);
+      }
+      ground_texture = tiled;
+    }
+    ground_material = make_shared<lambertian>(
+        make_shared<image_texture>(textures, ground_texture));
+  }
+  add_sphere(point3(0, -1000, 0), 1000, ground_material);
 
-  for (int a = -11; a < 11; a++) {
-    for (int b = -11; b < 11; b++) {
+  for (int a = -scene_extent; a < scene_extent; a++) {
+    for (int b = -scene_extent; b < scene_extent; b++) {
       auto choose_mat = random_double();
       point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
 
@@ -53,38 +171,70 @@ int main() {
           // diffuse
           auto albedo = color::random() * color::random();
           sphere_material = make_shared<lambertian>(albedo);
-          world .add(make_shared<sphere>(center, 0.2, sphere_material));
+          add_sphere(center, 0.2, sphere_material);
         } else if (choose_mat < 0.95) {
           // metal
           auto albedo = color::random(0.5, 1);
           auto fuzz = random_double(0, 0.5);
           sphere_material = make_shared<metal>(albedo, fuzz);
-          world.add(make_shared<sphere>(center, 0.2, sphere_material));
+          add_sphere(center, 0.2, sphere_material);
         } else {
           // glass
           sphere_material = make_shared<dielectric>(1.5);
-          world.add(make_shared<sphere>(center, 0.2, sphere_material));
+          add_sphere(center, 0.2, sphere_material);
         }
       }
     }
   }
 
   auto material1 = make_shared<dielectric>(1.5);
-  world.add(make_shared<sphere>(point3(0,1,0), 1.0, material1));
+  add_sphere(point3(0,1,0), 1.0, material1);
 
   auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-  world.add(make_shared<sphere>(point3(-4,1,0), 1.0, material2));
+  add_sphere(point3(-4,1,0), 1.0, material2);
 
   auto material3 = make_shared<metal>(color(0.7,0.6, 0.5), 0.0);
-  world.add(make_shared<sphere>(point3(4,1,0), 1.0, material3));
+  add_sphere(point3(4,1,0), 1.0, material3);
+
+  if (smoke && builder) {
+    std::clog << "Volumes aren't supported out of core, ignoring --smoke\n";
+  } else if (smoke) {
+    // Thin haze over everything, plus denser smoke drifting over the spheres
+    auto haze_boundary = make_shared<sphere>(point3(0, 0, 0), 40, nullptr);
+    world.add(make_shared<constant_medium>(haze_boundary, 0.01, color(1, 1, 1)));
+
+    shared_ptr<voxel_grid> density;
+    if (!smoke_file.empty()) {
+      density = make_shared<voxel_grid>(voxel_grid::load(smoke_file));
+    } else {
+      density = make_shared<voxel_grid>(
+          96, 32, 96, aabb(point3(-12, 0, -12), point3(12, 4, 12)));
+      const point3 plumes[] = {point3(-4, 1.5, 2), point3(3, 1, -3),
+                               point3(-7, 2, -6), point3(6, 2.5, 5),
+                               point3(0, 1, -8)};
+      for (int k = 0; k < density->nz; ++k)
+        for (int j = 0; j < density->ny; ++j)
+          for (int i = 0; i < density->nx; ++i) {
+            point3 p(-12 + (i + 0.5) * 0.25, (j + 0.5) * 0.125,
+                     -12 + (k + 0.5) * 0.25);
+            double d = 0;
+            for (const auto &c : plumes)
+              d += exp(-(p - c).length_squared() / 2.5);
+            // Leave empty space empty so tracking can skip it
+            density->at(i, j, k) = d > 0.05 ? static_cast<float>(d) : 0.0f;
+          }
+    }
+    world.add(make_shared<grid_medium>(density, 1.5, color(0.8, 0.8, 0.8),
+                                       smoke_block));
+  }
 
 
 
   camera cam;
 
   cam.aspect_ratio = 16.0 / 9.0;
-  cam.image_width = 1200;
-  cam.samples_per_pixel = 500;
+  cam.image_width = image_width;
+  cam.samples_per_pixel = samples_per_pixel;
   cam.max_depth = 50;
   
   cam.vfov = 20;
@@ -95,5 +245,60 @@ int main() {
   cam.defocus_angle = 0.6;
   cam.focus_dist = 10.0;
 
-  cam.render(world);
+  if (time_budget > 0 && builder)
+    std::clog << "Time budgets aren't supported out of core, ignoring "
+                 "--time-budget\n";
+  else
+    cam.time_budget = time_budget;
+
+  if (!preview_file.empty() && builder) {
+    std::clog << "Preview isn't supported out of core, ignoring --preview\n";
+  } else if (!preview_file.empty()) {
+    // Runs until the process is stopped
+    cam.render_preview(world, preview_file, frame_file);
+    return 0;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (builder) {
+    // Half the memory budget goes to mapped chunks and an eighth to the ray
+    // queue; the rest holds the scene index, the image and the paths in flight
+    size_t budget = scene_memory_mb * 1024 * 1024;
+    auto scene = builder->finish(budget / 2, budget / 8);
+    builder.reset();
+    size_t fixed_bytes = scene->resident_capacity() + scene->queue_bytes() +
+                         scene->index_bytes();
+    cam.ray_memory_bytes = budget > fixed_bytes ? budget - fixed_bytes : 0;
+    cam.render(*scene);
+    scene->print_stats(std::clog);
+    std::clog << "Memory bound: "
+              << (fixed_bytes + cam.ray_memory_bytes) / 1024 << " KiB ("
+              << scene->resident_capacity() / 1024 << " KiB chunks, "
+              << scene->queue_bytes() / 1024 << " KiB ray queue, "
+              << scene->index_bytes() / 1024 << " KiB scene index, "
+              << cam.ray_memory_bytes / 1024 << " KiB image and paths), "
+              << peak_rss_bytes() / 1024 << " KiB peak RSS\n";
+  } else {
+    cam.render(world);
+  }
+  std::clog << "Render time: "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start)
+                   .count()
+            << "s\n";
+
+  if (!ground_texture.empty())
+    textures->print_stats(std::clog);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  // Bad input files (textures, voxel grids) and I/O failures are reported
+  // as exceptions
+  try {
+    return run(argc, argv);
+  } catch (const std::exception &e) {
+    std::clog << "\nError: " << e.what() << '\n';
+    return 1;
+  }
 }
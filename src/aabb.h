@@ -0,0 +1,70 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "commonheader.h"
+
+#include <utility>
+
+class aabb {
+public:
+  interval x, y, z;
+
+  aabb() {} // The default AABB is empty, since intervals are empty by default.
+
+  aabb(const interval &ix, const interval &iy, const interval &iz)
+      : x(ix), y(iy), z(iz) {}
+
+  aabb(const point3 &a, const point3 &b) {
+    // Treat the two points a and b as extrema for the bounding box, so we
+    // don't require a particular minimum/maximum coordinate order.
+    x = interval(fmin(a[0], b[0]), fmax(a[0], b[0]));
+    y = interval(fmin(a[1], b[1]), fmax(a[1], b[1]));
+    z = interval(fmin(a[2], b[2]), fmax(a[2], b[2]));
+  }
+
+  aabb(const aabb &box0, const aabb &box1) {
+    // Smallest box enclosing both boxes
+    x = interval(fmin(box0.x.min, box1.x.min), fmax(box0.x.max, box1.x.max));
+    y = interval(fmin(box0.y.min, box1.y.min), fmax(box0.y.max, box1.y.max));
+    z = interval(fmin(box0.z.min, box1.z.min), fmax(box0.z.max, box1.z.max));
+  }
+
+  const interval &axis(int n) const {
+    if (n == 1)
+      return y;
+    if (n == 2)
+      return z;
+    return x;
+  }
+
+  point3 center() const {
+    return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max),
+                  0.5 * (z.min + z.max));
+  }
+
+  bool hit(const ray &r, interval &ray_t) const {
+    // Slab test. On a hit ray_t is narrowed to the part inside the box, so
+    // ray_t.min is the entry distance.
+    for (int a = 0; a < 3; a++) {
+      auto invD = 1 / r.direction()[a];
+      auto orig = r.origin()[a];
+
+      auto t0 = (axis(a).min - orig) * invD;
+      auto t1 = (axis(a).max - orig) * invD;
+
+      if (invD < 0)
+        std::swap(t0, t1);
+
+      if (t0 > ray_t.min)
+        ray_t.min = t0;
+      if (t1 < ray_t.max)
+        ray_t.max = t1;
+
+      if (ray_t.max <= ray_t.min)
+        return false;
+    }
+    return true;
+  }
+};
+
+#endif
@@ -8,8 +8,19 @@
 #include "material.h"
 #include "vec3.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+class chunked_scene;
 
 class camera {
 public:
@@ -27,9 +38,24 @@ public:
   double defocus_angle = 0; 
   double focus_dist = 10;
 
+  // Out-of-core scenes: bytes available for the image and the paths in
+  // flight, which sets the path batch size
+  size_t ray_memory_bytes = 256 * 1024 * 1024;
+
+  // Wall-clock budget in seconds. When positive, render ignores
+  // samples_per_pixel and keeps adding samples until the budget is spent.
+  double time_budget = 0;
+
+  int preview_block = 4; // Pixel block size of the first, coarse preview pass
+
   void render(const hittable &world) {
     init();
 
+    if (time_budget > 0) {
+      render_progressive(world);
+      return;
+    }
+
     std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
     for (int y = 0; y < image_height; ++y) {
@@ -48,6 +74,136 @@ public:
     std::clog << "\rDone.                   \n";
   }
 
+  // Breadth-first render for scenes streamed from disk, defined in
+  // chunked_scene.h
+  void render(chunked_scene &world);
+
+  void render_preview(const hittable &world, const std::string &camera_file,
+                      const std::string &frame_file) {
+    // Long-running interactive mode. Renders progressively and publishes each
+    // pass to frame_file (a binary PPM, replaced atomically so a viewer can
+    // poll it). Whenever camera_file changes the new view parameters are
+    // loaded and rendering restarts from scratch on the same world. Each
+    // restart begins with one sample per preview_block^2 pixel block, then
+    // refines at full resolution until samples_per_pixel is reached.
+    namespace fs = std::filesystem;
+    using clock = std::chrono::steady_clock;
+
+    if (!fs::exists(camera_file))
+      save(camera_file);
+
+    // Polls the camera file, at most every couple of milliseconds, and
+    // applies its parameters once they have changed and parse. Timestamps
+    // are coarse, so a write landing in the same tick as the previous one
+    // keeps the mtime: for a while after each write the contents are
+    // compared too. A read that raced a write (the file changed while being
+    // read) is discarded and retried on the next poll.
+    fs::file_time_type seen_time;
+    uintmax_t seen_size = 0;
+    std::string seen_text;
+    auto last_poll = clock::now() - std::chrono::seconds(1);
+    auto changed = [&] {
+      auto now = clock::now();
+      if (now - last_poll < std::chrono::milliseconds(2))
+        return false;
+      last_poll = now;
+
+      std::error_code error;
+      auto time = fs::last_write_time(camera_file, error);
+      auto size = error ? 0 : fs::file_size(camera_file, error);
+      if (error)
+        return false;
+      bool settling =
+          fs::file_time_type::clock::now() - time < std::chrono::seconds(1);
+      if (time == seen_time && size == seen_size && !settling)
+        return false;
+
+      std::string text;
+      if (!read_text(camera_file, text) ||
+          fs::last_write_time(camera_file, error) != time || error ||
+          fs::file_size(camera_file, error) != size || error)
+        return false;
+      seen_time = time;
+      seen_size = size;
+      if (text == seen_text)
+        return false;
+      seen_text = text;
+      return parse(text);
+    };
+    changed(); // Initial load
+
+    for (long frame = 0;; ++frame) {
+      init();
+      std::vector<color> pixels(static_cast<size_t>(image_width) *
+                                image_height);
+      bool restart = false;
+
+      // Coarse pass: one sample per block, splatted over the whole block
+      int block = std::max(1, preview_block);
+      for (int by = 0; by < image_height && !restart; by += block) {
+        for (int bx = 0; bx < image_width; bx += block) {
+          int cx = std::min(bx + block / 2, image_width - 1);
+          int cy = std::min(by + block / 2, image_height - 1);
+          color sample = ray_color(get_ray(cx, cy), max_depth, world);
+          for (int y = by; y < std::min(by + block, image_height); ++y)
+            for (int x = bx; x < std::min(bx + block, image_width); ++x)
+              pixels[static_cast<size_t>(y) * image_width + x] = sample;
+        }
+        restart = changed();
+      }
+      if (!restart)
+        publish_frame(frame_file, pixels, 1, frame);
+
+      // Refinement passes at full resolution
+      std::fill(pixels.begin(), pixels.end(), color(0, 0, 0));
+      for (int spp = 1; spp <= samples_per_pixel && !restart; ++spp) {
+        for (int y = 0; y < image_height && !restart; ++y) {
+          for (int x = 0; x < image_width; ++x) {
+            ray r = get_ray(x, y);
+            pixels[static_cast<size_t>(y) * image_width + x] +=
+                ray_color(r, max_depth, world);
+            if ((x & 31) == 31 && changed()) {
+              restart = true;
+              break;
+            }
+          }
+        }
+        if (!restart)
+          publish_frame(frame_file, pixels, spp, frame);
+      }
+
+      // Converged, wait for the next edit
+      while (!restart) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        restart = changed();
+      }
+    }
+  }
+
+  bool load(const std::string &path) {
+    // Reads "name value..." lines (e.g. "lookfrom 13 2 3") from a camera
+    // file. Missing parameters keep their current values and '#' starts a
+    // comment. If any line is malformed nothing is changed.
+    std::string text;
+    return read_text(path, text) && parse(text);
+  }
+
+  void save(const std::string &path) const {
+    // Writes the current parameters in the format load reads
+    std::ofstream out(path);
+    out << std::setprecision(10);
+    out << "aspect_ratio " << aspect_ratio << '\n'
+        << "image_width " << image_width << '\n'
+        << "samples_per_pixel " << samples_per_pixel << '\n'
+        << "max_depth " << max_depth << '\n'
+        << "vfov " << vfov << '\n'
+        << "lookfrom " << lookfrom << '\n'
+        << "lookat " << lookat << '\n'
+        << "vup " << vup << '\n'
+        << "defocus_angle " << defocus_angle << '\n'
+        << "focus_dist " << focus_dist << '\n';
+  }
+
 private:
   int image_height; // Rendered image height
   point3 center; // Camera Center
@@ -59,6 +215,198 @@ private:
   vec3 w; // Camera frame basis vectors
   vec3 defocus_disk_u; // DEfocus disk horizontal radius
   vec3 defocus_disk_v; // Defocus disk vertical radius
+  double pixel_spread_angle; // Angle subtended by one pixel, for texture filtering
+  mutable bool publish_failed = false; // Last preview frame couldn't be written
+
+  static bool read_text(const std::string &path, std::string &text) {
+    std::ifstream in(path);
+    if (!in)
+      return false;
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    text = contents.str();
+    return true;
+  }
+
+  bool parse(const std::string &text) {
+    // Parses into a copy so a malformed (or half written) file can't leave
+    // the camera with some parameters changed and others zeroed
+    camera next = *this;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line.substr(0, line.find('#')));
+      std::string name;
+      if (!(fields >> name))
+        continue;
+
+      if (name == "aspect_ratio")
+        fields >> next.aspect_ratio;
+      else if (name == "image_width")
+        fields >> next.image_width;
+      else if (name == "samples_per_pixel")
+        fields >> next.samples_per_pixel;
+      else if (name == "max_depth")
+        fields >> next.max_depth;
+      else if (name == "vfov")
+        fields >> next.vfov;
+      else if (name == "lookfrom")
+        fields >> next.lookfrom[0] >> next.lookfrom[1] >> next.lookfrom[2];
+      else if (name == "lookat")
+        fields >> next.lookat[0] >> next.lookat[1] >> next.lookat[2];
+      else if (name == "vup")
+        fields >> next.vup[0] >> next.vup[1] >> next.vup[2];
+      else if (name == "defocus_angle")
+        fields >> next.defocus_angle;
+      else if (name == "focus_dist")
+        fields >> next.focus_dist;
+      else {
+        std::clog << "\nUnknown camera parameter: " << name << '\n';
+        continue;
+      }
+
+      if (!fields || !(fields >> std::ws).eof()) {
+        std::clog << "\nIgnoring camera file, malformed line: " << line
+                  << '\n';
+        return false;
+      }
+    }
+
+    *this = next;
+    return true;
+  }
+
+  void render_progressive(const hittable &world) {
+    // Traces one sample per pixel a scanline at a time, cycling over the
+    // image until the deadline. A scanline is only started if its measured
+    // cost says it will finish in time, so the render stops just before the
+    // budget runs out. Rows are visited coarse to fine (every 16th row, then
+    // the ones halfway between, ...), so a pass cut short still covers the
+    // whole image evenly. Each row is normalized by its own sample count, and
+    // rows never reached in the first pass copy the nearest traced row.
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    auto elapsed = [&start] {
+      return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    std::vector<int> order;
+    std::vector<bool> queued(image_height, false);
+    for (int step = 16; step >= 1; step /= 2)
+      for (int y = 0; y < image_height; y += step)
+        if (!queued[y]) {
+          queued[y] = true;
+          order.push_back(y);
+        }
+
+    std::vector<color> pixels(static_cast<size_t>(image_width) * image_height);
+    std::vector<int> row_samples(image_height, 0);
+    std::vector<double> row_seconds(image_height, 0); // Cost of the last pass
+    double pass_seconds = 0; // Sum of row_seconds
+    long rows_traced = 0;
+
+    for (size_t i = 0;; i = (i + 1) % order.size()) {
+      int y = order[i];
+
+      // Rows not yet traced are assumed to cost the average so far
+      double now = elapsed();
+      double expected = rows_traced >= image_height ? row_seconds[y]
+                        : rows_traced > 0           ? pass_seconds / rows_traced
+                                                    : 0;
+      if (rows_traced > 0 && now + expected > time_budget)
+        break;
+
+      for (int x = 0; x < image_width; ++x) {
+        ray r = get_ray(x, y);
+        pixels[static_cast<size_t>(y) * image_width + x] +=
+            ray_color(r, max_depth, world);
+      }
+      ++row_samples[y];
+      ++rows_traced;
+
+      double cost = elapsed() - now;
+      pass_seconds += cost - row_seconds[y];
+      row_seconds[y] = cost;
+
+      // Until the first pass is done, extrapolate its cost from rows so far
+      double full_pass = rows_traced >= image_height
+                             ? pass_seconds
+                             : pass_seconds * image_height / rows_traced;
+      double remaining = std::fmax(time_budget - elapsed(), 0.0);
+      double spp = static_cast<double>(rows_traced) / image_height;
+      // Formatted locally so std::clog's own precision is left alone
+      std::ostringstream line;
+      line << std::fixed << std::setprecision(1) << spp << " spp, "
+           << remaining << "s remaining, ~" << spp + remaining / full_pass
+           << " spp at deadline   ";
+      std::clog << "\r" << line.str() << std::flush;
+    }
+
+    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    for (int y = 0; y < image_height; ++y) {
+      int source = y;
+      for (int d = 1; row_samples[source] == 0; ++d) {
+        if (y - d >= 0 && row_samples[y - d] > 0)
+          source = y - d;
+        else if (y + d < image_height && row_samples[y + d] > 0)
+          source = y + d;
+      }
+      for (int x = 0; x < image_width; ++x)
+        write_color(std::cout,
+                    pixels[static_cast<size_t>(source) * image_width + x],
+                    row_samples[source]);
+    }
+
+    std::ostringstream done;
+    done << std::fixed << std::setprecision(1)
+         << static_cast<double>(rows_traced) / image_height << " spp in "
+         << elapsed() << "s of " << time_budget << "s budget.";
+    std::clog << "\rDone: " << done.str() << "                    \n";
+  }
+
+  void publish_frame(const std::string &path, const std::vector<color> &pixels,
+                     int samples, long frame) const {
+    // Writes to a temporary file and renames it over path, so a viewer never
+    // reads a half written frame
+    std::string temp = path + ".tmp";
+    {
+      std::ofstream out(temp, std::ios::binary);
+      out << "P6\n# frame " << frame << " spp " << samples << '\n'
+          << image_width << ' ' << image_height << "\n255\n";
+      std::vector<unsigned char> bytes(pixels.size() * 3);
+      for (size_t i = 0; i < pixels.size(); ++i) {
+        int rgb[3];
+        color_to_rgb(pixels[i], samples, rgb);
+        for (int c = 0; c < 3; ++c)
+          bytes[i * 3 + c] = static_cast<unsigned char>(rgb[c]);
+      }
+      out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+      out.close();
+      if (!out) {
+        warn_publish_failed("cannot write " + temp);
+        return;
+      }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+    if (error) {
+      warn_publish_failed("cannot rename " + temp + " to " + path + ": " +
+                          error.message());
+      return;
+    }
+    publish_failed = false;
+
+    std::clog << "\rPreview frame " << frame << ": " << samples << " spp   "
+              << std::flush;
+  }
+
+  void warn_publish_failed(const std::string &message) const {
+    // Warns once per run of failures rather than on every frame
+    if (!publish_failed)
+      std::clog << "\nWarning: preview frame not published, " << message
+                << '\n';
+    publish_failed = true;
+  }
 
   void init() {
     // Calculate the image height, and ensure that it's at least 1
@@ -101,6 +449,7 @@ private:
     // divded into identical regions
     pixel_delta_u = viewport_u / image_width;
     pixel_delta_v = viewport_v / image_height;
+    pixel_spread_angle = 2.0 * h / image_height;
 
     // Calculate the location of the upper left pixel.
     auto viewport_upper_left = center - (focus_dist * w) - viewport_u/2 - viewport_v/2;
@@ -114,7 +463,10 @@ private:
     defocus_disk_v = v * defocus_radius;
   }
 
-  color ray_color(const ray &r, int depth, const hittable &world) const {
+  color ray_color(const ray &r, int depth, const hittable &world,
+                  double cone_width = 0) const {
+    // cone_width tracks how wide the pixel footprint has grown along the path
+    // so that textures can be sampled at a matching mip level
     hit_record rec;
 
     // If we're exceeded ray bounce limit, no more light is gathered
@@ -122,14 +474,21 @@ private:
       return color(0, 0, 0);
 
     if (world.hit(r, interval(0.001, infinity), rec)) {
+      rec.footprint =
+          cone_width + pixel_spread_angle * rec.t * r.direction().length();
       ray scattered;
       color attenuation;
       if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-        return attenuation * ray_color(scattered, depth - 1, world);
+        return attenuation *
+               ray_color(scattered, depth - 1, world, rec.footprint);
       }
       return color(0, 0, 0);
     }
 
+    return background(r);
+  }
+
+  color background(const ray &r) const {
     vec3 unit_direction = unit_vector(r.direction());
     auto a = 0.5 * (unit_direction.y() + 1.0);
     return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
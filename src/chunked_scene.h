@@ -0,0 +1,976 @@
+#ifndef CHUNKED_SCENE_H
+#define CHUNKED_SCENE_H
+
+#include "commonheader.h"
+
+#include "aabb.h"
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Out-of-core sphere scenes.
+//
+// Spheres are split spatially into chunks of roughly a target byte size. Each
+// chunk is stored on disk as a flat BVH followed by compact 40 byte sphere
+// records, and is mapped into memory only while rays are being traced against
+// it. Untextured lambertian, metal and dielectric materials are stored inline
+// in the records; any other material is shared through an in-memory palette.
+//
+// File layout (.rtcs):
+//   "RTCS" | version | chunk_count | reserved
+//   chunk_count x chunk_info
+//   chunk data, each chunk starting on a chunked_scene_alignment boundary
+//
+// Chunks are packed tightly rather than page aligned; mapping starts at the
+// page containing a chunk's first byte.
+
+const uint32_t chunked_scene_magic = 0x53435452; // "RTCS" little endian
+const uint32_t chunked_scene_version = 2;
+const uint64_t chunked_scene_alignment = 64; // Keeps records cache line aligned
+
+enum chunk_material_type : uint32_t {
+  chunk_lambertian,
+  chunk_metal,
+  chunk_dielectric,
+  chunk_palette,
+};
+
+struct chunk_material {
+  uint32_t type;    // chunk_material_type
+  uint32_t palette; // Palette index, for chunk_palette only
+  float albedo[3];
+  float param;      // Metal fuzz or dielectric index of refraction
+};
+
+struct chunk_sphere {
+  float center[3];
+  float radius;
+  chunk_material material;
+};
+
+struct chunk_node {
+  float bmin[3];
+  float bmax[3];
+  uint32_t first; // Leaf: first sphere. Interior: index of the right child
+  uint32_t count; // Leaf: sphere count. Interior: 0, left child follows
+};
+
+struct chunk_info {
+  double bmin[3];
+  double bmax[3];
+  uint64_t offset;
+  uint64_t bytes;
+  uint32_t node_count;
+  uint32_t sphere_count;
+};
+
+inline size_t peak_rss_bytes() {
+  // Peak resident set size of the whole process
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return counters.PeakWorkingSetSize;
+#else
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return static_cast<size_t>(usage.ru_maxrss);
+#else
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+class chunked_scene {
+public:
+  struct query {
+    ray r;
+    hit_record rec;
+    chunk_material material; // Material of the closest hit
+    bool hit;
+  };
+
+  struct stats {
+    uint64_t chunk_loads = 0;
+    uint64_t chunk_evictions = 0;
+    uint64_t bytes_mapped = 0;
+    uint64_t rays_queued = 0;
+    uint64_t rays_culled = 0; // Queued rays skipped since a closer hit exists
+    uint64_t queue_drains = 0;
+    size_t peak_resident_bytes = 0;
+  };
+
+  // Chunks are mapped until their total mapped size (whole pages) would
+  // exceed max_resident_bytes; the least recently used ones are unmapped
+  // first. A single chunk larger than the cap is still mapped on its own.
+  // Ray queues hold at most max_queue_bytes of entries (but always enough for
+  // one ray to enter every chunk).
+  chunked_scene(const std::string &path,
+                std::vector<shared_ptr<material>> _materials,
+                size_t max_resident_bytes, size_t max_queue_bytes)
+      : materials(std::move(_materials)), capacity(max_resident_bytes) {
+    std::ifstream in(path, std::ios::binary);
+    uint32_t header[4] = {};
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (!in || header[0] != chunked_scene_magic ||
+        header[1] != chunked_scene_version)
+      throw std::runtime_error("not a chunked scene file " + path);
+
+    chunks.resize(header[2]);
+    in.read(reinterpret_cast<char *>(chunks.data()),
+            chunks.size() * sizeof(chunk_info));
+    if (!in)
+      throw std::runtime_error("corrupt chunked scene file " + path);
+
+    for (const auto &info : chunks)
+      bounds.push_back(aabb(point3(info.bmin[0], info.bmin[1], info.bmin[2]),
+                            point3(info.bmax[0], info.bmax[1], info.bmax[2])));
+    resident.resize(chunks.size());
+    queue_capacity =
+        std::max(max_queue_bytes / sizeof(queue_entry), chunks.size());
+    queue.reserve(queue_capacity);
+    queue_ranges.reserve(chunks.size());
+
+    for (uint32_t c = 0; c < chunks.size(); ++c)
+      chunk_order.push_back(c);
+    if (!chunks.empty())
+      build_top(0, static_cast<uint32_t>(chunks.size()));
+
+#ifdef _WIN32
+    file.open(path, std::ios::binary);
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("cannot open chunked scene file " + path);
+#endif
+  }
+
+  chunked_scene(const chunked_scene &) = delete;
+  chunked_scene &operator=(const chunked_scene &) = delete;
+
+  ~chunked_scene() {
+    for (size_t c = 0; c < resident.size(); ++c)
+      unload(c);
+#ifndef _WIN32
+    ::close(fd);
+#endif
+  }
+
+  void intersect(std::vector<query> &queries) {
+    // Finds the closest hit for every query ray. Rays are queued on all
+    // chunks their path overlaps until the queue is full, then the queue is
+    // drained: each queued chunk is paged in once and tested against all of
+    // its rays. A ray is always queued on all of its chunks in the same
+    // drain, so its closest hit is final once that drain is done.
+    for (size_t i = 0; i < queries.size(); ++i) {
+      auto &q = queries[i];
+      q.hit = false;
+      q.rec.t = infinity;
+      if (top.empty())
+        continue;
+      if (queue.size() + chunks.size() > queue_capacity)
+        drain(queries);
+      enqueue(static_cast<uint32_t>(i), q.r);
+    }
+    drain(queries);
+  }
+
+  bool scatter(const query &q, color &attenuation, ray &scattered) const {
+    // Scatters a hit query. Inline materials are rebuilt on the stack, which
+    // is cheap now that untextured materials don't allocate.
+    const auto &m = q.material;
+    color albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+    switch (m.type) {
+    case chunk_lambertian:
+      return lambertian(albedo).scatter(q.r, q.rec, attenuation, scattered);
+    case chunk_metal:
+      return metal(albedo, m.param).scatter(q.r, q.rec, attenuation, scattered);
+    case chunk_dielectric:
+      return dielectric(m.param).scatter(q.r, q.rec, attenuation, scattered);
+    default:
+      return q.rec.mat->scatter(q.r, q.rec, attenuation, scattered);
+    }
+  }
+
+  stats statistics() const { return counters; }
+
+  size_t resident_capacity() const { return capacity; }
+
+  size_t index_bytes() const {
+    // Memory held for the whole render regardless of the rays traced: chunk
+    // table, top-level BVH, per-chunk bookkeeping and the palette
+    return chunks.capacity() * sizeof(chunk_info) +
+           bounds.capacity() * sizeof(aabb) + top.capacity() * sizeof(top_node) +
+           chunk_order.capacity() * sizeof(uint32_t) +
+           resident.capacity() * sizeof(resident_chunk) +
+           queue_ranges.capacity() * sizeof(queue_range) +
+           chunks.size() * (sizeof(size_t) + 2 * sizeof(void *)) + // lru
+           materials.capacity() * sizeof(shared_ptr<material>);
+  }
+
+  size_t queue_bytes() const { return queue.capacity() * sizeof(queue_entry); }
+
+  void print_stats(std::ostream &out) const {
+    out << "Chunked scene: " << chunks.size() << " chunks, "
+        << counters.chunk_loads << " loads, " << counters.chunk_evictions
+        << " evictions, " << counters.bytes_mapped / 1024 << " KiB mapped\n"
+        << "               " << counters.rays_queued << " ray/chunk tests, "
+        << counters.rays_culled << " culled, " << counters.queue_drains
+        << " queue drains\n"
+        << "               " << counters.peak_resident_bytes / 1024
+        << " KiB peak resident chunks of " << capacity / 1024
+        << " KiB cap\n";
+  }
+
+private:
+  struct queue_entry {
+    uint32_t chunk;
+    uint32_t ray;
+    double t_enter;
+  };
+
+  struct queue_range {
+    size_t chunk;
+    size_t first, last; // Entries of the sorted queue
+  };
+
+  struct top_node {
+    aabb box;
+    uint32_t first; // Leaf: first entry of chunk_order. Interior: right child
+    uint32_t count; // Leaf: chunk count. Interior: 0, left child follows
+  };
+
+  struct resident_chunk {
+    const unsigned char *data = nullptr;
+    std::list<size_t>::iterator lru_position;
+#ifdef _WIN32
+    std::vector<unsigned char> buffer;
+#else
+    void *mapping = nullptr;
+    size_t mapping_bytes = 0;
+#endif
+  };
+
+  std::vector<shared_ptr<material>> materials;
+  std::vector<chunk_info> chunks;
+  std::vector<aabb> bounds;
+  std::vector<top_node> top; // In-memory BVH over the chunk bounds
+  std::vector<uint32_t> chunk_order;
+  std::vector<resident_chunk> resident;
+  std::vector<queue_entry> queue; // All chunks' ray entries, unsorted
+  size_t queue_capacity;
+  std::vector<queue_range> queue_ranges;
+  size_t capacity;
+  size_t resident_bytes = 0;
+  std::list<size_t> lru; // Resident chunks, most recently used at the front
+  stats counters;
+#ifdef _WIN32
+  std::ifstream file;
+#else
+  int fd = -1;
+#endif
+
+  uint32_t build_top(uint32_t begin, uint32_t end) {
+    // Median split over chunk centers, mirroring the per-chunk BVH
+    uint32_t index = static_cast<uint32_t>(top.size());
+    top.push_back({});
+
+    top_node node = {bounds[chunk_order[begin]], begin, end - begin};
+    for (uint32_t i = begin + 1; i < end; ++i)
+      node.box = aabb(node.box, bounds[chunk_order[i]]);
+
+    if (end - begin > 2) {
+      int axis = 0;
+      for (int a = 1; a < 3; ++a)
+        if (node.box.axis(a).max - node.box.axis(a).min >
+            node.box.axis(axis).max - node.box.axis(axis).min)
+          axis = a;
+
+      uint32_t mid = begin + (end - begin) / 2;
+      std::nth_element(chunk_order.begin() + begin, chunk_order.begin() + mid,
+                       chunk_order.begin() + end,
+                       [this, axis](uint32_t a, uint32_t b) {
+                         return bounds[a].center()[axis] <
+                                bounds[b].center()[axis];
+                       });
+
+      build_top(begin, mid);
+      node.first = build_top(mid, end);
+      node.count = 0;
+    }
+
+    top[index] = node;
+    return index;
+  }
+
+  void enqueue(uint32_t query_index, const ray &r) {
+    // Queues the ray on every chunk whose bounds it passes through
+    uint32_t stack[64];
+    int depth = 0;
+    stack[depth++] = 0;
+
+    while (depth > 0) {
+      uint32_t index = stack[--depth];
+      const auto &node = top[index];
+      interval ray_t(0.001, infinity);
+      if (!node.box.hit(r, ray_t))
+        continue;
+
+      if (node.count == 0) {
+        stack[depth++] = node.first;
+        stack[depth++] = index + 1;
+        continue;
+      }
+
+      for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+        uint32_t c = chunk_order[i];
+        ray_t = interval(0.001, infinity);
+        if (bounds[c].hit(r, ray_t))
+          queue.push_back({c, query_index, ray_t.min});
+      }
+    }
+  }
+
+  void drain(std::vector<query> &queries) {
+    // Sorts the queue by chunk and traces each chunk's rays. Resident chunks
+    // go first, which both avoids a reload and lets earlier hits cull rays
+    // from the chunks loaded later.
+    if (queue.empty())
+      return;
+    ++counters.queue_drains;
+    std::sort(queue.begin(), queue.end(),
+              [](const queue_entry &a, const queue_entry &b) {
+                return a.chunk != b.chunk ? a.chunk < b.chunk : a.ray < b.ray;
+              });
+
+    queue_ranges.clear();
+    for (size_t i = 0; i < queue.size();) {
+      size_t j = i;
+      while (j < queue.size() && queue[j].chunk == queue[i].chunk)
+        ++j;
+      queue_ranges.push_back({queue[i].chunk, i, j});
+      i = j;
+    }
+    std::partition(
+        queue_ranges.begin(), queue_ranges.end(),
+        [this](const queue_range &r) { return resident[r.chunk].data; });
+
+    for (const auto &range : queue_ranges) {
+      const unsigned char *data = load(range.chunk);
+      const auto *nodes = reinterpret_cast<const chunk_node *>(data);
+      const auto *spheres = reinterpret_cast<const chunk_sphere *>(
+          data + chunks[range.chunk].node_count * sizeof(chunk_node));
+
+      counters.rays_queued += range.last - range.first;
+      for (size_t i = range.first; i < range.last; ++i) {
+        auto &q = queries[queue[i].ray];
+        if (queue[i].t_enter >= q.rec.t) {
+          ++counters.rays_culled;
+          continue;
+        }
+        traverse(nodes, spheres, q);
+      }
+    }
+    queue.clear();
+  }
+
+  const unsigned char *load(size_t c) {
+    auto &chunk = resident[c];
+    if (chunk.data) {
+      lru.splice(lru.begin(), lru, chunk.lru_position);
+      return chunk.data;
+    }
+
+    // Make room by unmapping the least recently used chunks
+    size_t bytes = chunks[c].bytes;
+    while (resident_bytes + resident_size(c) > capacity && !lru.empty()) {
+      unload(lru.back());
+      ++counters.chunk_evictions;
+    }
+
+#ifdef _WIN32
+    chunk.buffer.resize(bytes);
+    file.seekg(chunks[c].offset);
+    file.read(reinterpret_cast<char *>(chunk.buffer.data()), bytes);
+    if (!file)
+      throw std::runtime_error("failed reading scene chunk");
+    chunk.data = chunk.buffer.data();
+#else
+    static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t skew = chunks[c].offset % page;
+    size_t mapping_bytes = static_cast<size_t>(bytes + skew);
+    void *mapping = mmap(nullptr, mapping_bytes, PROT_READ, MAP_PRIVATE, fd,
+                         static_cast<off_t>(chunks[c].offset - skew));
+    if (mapping == MAP_FAILED)
+      throw std::runtime_error("failed mapping scene chunk");
+    // The whole chunk is about to be traversed, so ask for it up front
+    madvise(mapping, mapping_bytes, MADV_WILLNEED);
+    chunk.mapping = mapping;
+    chunk.mapping_bytes = mapping_bytes;
+    chunk.data = static_cast<const unsigned char *>(mapping) + skew;
+#endif
+
+    lru.push_front(c);
+    chunk.lru_position = lru.begin();
+    resident_bytes += resident_size(c);
+    ++counters.chunk_loads;
+    counters.bytes_mapped += bytes;
+    counters.peak_resident_bytes =
+        std::max(counters.peak_resident_bytes, resident_bytes);
+    return chunk.data;
+  }
+
+  void unload(size_t c) {
+    auto &chunk = resident[c];
+    if (!chunk.data)
+      return;
+#ifdef _WIN32
+    std::vector<unsigned char>().swap(chunk.buffer);
+#else
+    munmap(chunk.mapping, chunk.mapping_bytes);
+    chunk.mapping = nullptr;
+#endif
+    chunk.data = nullptr;
+    lru.erase(chunk.lru_position);
+    resident_bytes -= resident_size(c);
+  }
+
+  size_t resident_size(size_t c) const {
+    // Memory a loaded chunk occupies: the chunk itself when read into a
+    // buffer, or every page its mapping touches
+#ifdef _WIN32
+    return static_cast<size_t>(chunks[c].bytes);
+#else
+    static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t first = chunks[c].offset / page * page;
+    uint64_t last = (chunks[c].offset + chunks[c].bytes + page - 1) / page * page;
+    return static_cast<size_t>(last - first);
+#endif
+  }
+
+  static bool hit_node(const chunk_node &node, const ray &r, double t_max) {
+    interval ray_t(0.001, t_max);
+    return aabb(point3(node.bmin[0], node.bmin[1], node.bmin[2]),
+                point3(node.bmax[0], node.bmax[1], node.bmax[2]))
+        .hit(r, ray_t);
+  }
+
+  void traverse(const chunk_node *nodes, const chunk_sphere *spheres,
+                query &q) const {
+    uint32_t stack[64];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+      const auto &node = nodes[stack[--top]];
+      if (!hit_node(node, q.r, q.rec.t))
+        continue;
+
+      if (node.count == 0) {
+        uint32_t index = static_cast<uint32_t>(&node - nodes);
+        stack[top++] = node.first;
+        stack[top++] = index + 1;
+        continue;
+      }
+
+      for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+        const auto &s = spheres[i];
+        point3 center(s.center[0], s.center[1], s.center[2]);
+        if (sphere::hit_sphere(center, s.radius, q.r,
+                               interval(0.001, q.rec.t), q.rec)) {
+          q.hit = true;
+          q.material = s.material;
+          q.rec.mat = s.material.type == chunk_palette
+                          ? materials[s.material.palette]
+                          : nullptr;
+        }
+      }
+    }
+  }
+};
+
+class chunked_scene_builder {
+public:
+  // Spheres are binned by center into an nx * ny * nz grid over grid_bounds
+  // (centers outside it go to the nearest edge bin); only a 4 byte count per
+  // bin is kept. Records are buffered and appended to a single temporary file
+  // whenever the buffer reaches max_buffered_bytes, so the builder never holds
+  // the whole scene. finish() then groups neighbouring bins into chunks of
+  // about target_chunk_bytes, so bins should be small compared to a chunk.
+  chunked_scene_builder(const std::string &_path, const aabb &grid_bounds,
+                        int _nx, int _ny, int _nz,
+                        size_t _target_chunk_bytes = 1024 * 1024,
+                        size_t _max_buffered_bytes = 16 * 1024 * 1024)
+      : path(_path), grid(grid_bounds), nx(_nx), ny(_ny), nz(_nz),
+        target_chunk_bytes(_target_chunk_bytes),
+        max_buffered_bytes(std::max(_max_buffered_bytes,
+                                    2 * sizeof(chunk_sphere))),
+        bin_counts(static_cast<size_t>(_nx) * _ny * _nz, 0) {}
+
+  chunked_scene_builder(const chunked_scene_builder &) = delete;
+  chunked_scene_builder &operator=(const chunked_scene_builder &) = delete;
+
+  ~chunked_scene_builder() {
+    std::remove(spill_path().c_str());
+    std::remove(sorted_path().c_str());
+  }
+
+  static size_t bin_bytes() { return sizeof(uint32_t); }
+
+  void add(const point3 &center, double radius, shared_ptr<material> mat) {
+    chunk_sphere s = {{static_cast<float>(center.x()),
+                       static_cast<float>(center.y()),
+                       static_cast<float>(center.z())},
+                      static_cast<float>(radius),
+                      describe(mat)};
+    ++bin_counts[bin_index(s)];
+    ++sphere_count;
+    pending.push_back(s);
+    if (pending.size() * sizeof(chunk_sphere) >= max_buffered_bytes)
+      flush();
+  }
+
+  size_t size() const { return sphere_count; }
+
+  shared_ptr<chunked_scene> finish(size_t max_resident_bytes,
+                                   size_t max_queue_bytes) {
+    // Groups bins into chunks, sorts the records by chunk, builds each chunk's
+    // BVH and writes the final scene file
+    std::vector<bin_region> regions;
+    partition({{0, 0, 0}, {nx, ny, nz}}, regions);
+
+    // From here on each bin holds its chunk index instead of its count
+    std::vector<uint64_t> first(regions.size() + 1, 0);
+    for (size_t c = 0; c < regions.size(); ++c) {
+      first[c + 1] = first[c] + region_count(regions[c]);
+      for_each_bin(regions[c], [&](size_t b) {
+        bin_counts[b] = static_cast<uint32_t>(c);
+      });
+    }
+
+    std::fstream sorted;
+    if (spilled) {
+      flush();
+      sort_spill(first, sorted);
+    } else {
+      std::sort(pending.begin(), pending.end(),
+                [this](const chunk_sphere &a, const chunk_sphere &b) {
+                  return bin_counts[bin_index(a)] < bin_counts[bin_index(b)];
+                });
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+      throw std::runtime_error("cannot write chunked scene " + path);
+
+    // Chunk table is written last, once offsets are known
+    std::vector<chunk_info> infos(regions.size());
+    uint64_t offset = align(4 * sizeof(uint32_t) +
+                            regions.size() * sizeof(chunk_info));
+    std::vector<chunk_sphere> spheres;
+    for (size_t c = 0; c < regions.size(); ++c) {
+      if (spilled) {
+        spheres.resize(first[c + 1] - first[c]);
+        sorted.seekg(first[c] * sizeof(chunk_sphere));
+        sorted.read(reinterpret_cast<char *>(spheres.data()),
+                    spheres.size() * sizeof(chunk_sphere));
+        if (!sorted)
+          throw std::runtime_error("cannot read " + sorted_path());
+      } else {
+        spheres.assign(pending.begin() + first[c],
+                       pending.begin() + first[c + 1]);
+      }
+
+      std::vector<chunk_node> nodes;
+      build(nodes, spheres, 0, static_cast<uint32_t>(spheres.size()));
+
+      auto &info = infos[c];
+      for (int a = 0; a < 3; ++a) {
+        info.bmin[a] = nodes[0].bmin[a];
+        info.bmax[a] = nodes[0].bmax[a];
+      }
+      info.offset = offset;
+      info.node_count = static_cast<uint32_t>(nodes.size());
+      info.sphere_count = static_cast<uint32_t>(spheres.size());
+      info.bytes = nodes.size() * sizeof(chunk_node) +
+                   spheres.size() * sizeof(chunk_sphere);
+
+      out.seekp(offset);
+      out.write(reinterpret_cast<const char *>(nodes.data()),
+                nodes.size() * sizeof(chunk_node));
+      out.write(reinterpret_cast<const char *>(spheres.data()),
+                spheres.size() * sizeof(chunk_sphere));
+      offset = align(offset + info.bytes);
+    }
+    std::vector<chunk_sphere>().swap(spheres);
+    std::vector<chunk_sphere>().swap(pending);
+    if (sorted.is_open()) {
+      sorted.close();
+      std::remove(sorted_path().c_str());
+    }
+
+    uint32_t header[4] = {chunked_scene_magic, chunked_scene_version,
+                          static_cast<uint32_t>(infos.size()), 0};
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(infos.data()),
+              infos.size() * sizeof(chunk_info));
+    out.close();
+    if (!out)
+      throw std::runtime_error("failed writing chunked scene " + path);
+
+    return make_shared<chunked_scene>(path, materials, max_resident_bytes,
+                                      max_queue_bytes);
+  }
+
+private:
+  struct bin_region {
+    int lo[3]; // Inclusive
+    int hi[3]; // Exclusive
+  };
+
+  std::string path;
+  aabb grid;
+  int nx, ny, nz;
+  size_t target_chunk_bytes;
+  size_t max_buffered_bytes;
+  std::vector<chunk_sphere> pending; // Not yet spilled
+  bool spilled = false;
+  std::vector<uint32_t> bin_counts;
+  std::unordered_map<material *, uint32_t> palette;
+  std::vector<shared_ptr<material>> materials;
+  size_t sphere_count = 0;
+
+  std::string spill_path() const { return path + ".spill"; }
+  std::string sorted_path() const { return path + ".sorted"; }
+
+  chunk_material describe(const shared_ptr<material> &mat) {
+    // Stores untextured built-in materials inline. Anything else goes into
+    // the palette, which is only meant for the few materials shared by many
+    // spheres (a textured ground, say); it stays in memory.
+    chunk_material m = {chunk_palette, 0, {0, 0, 0}, 0};
+    color albedo;
+    if (auto l = dynamic_cast<const lambertian *>(mat.get());
+        l && l->constant_albedo(albedo)) {
+      m.type = chunk_lambertian;
+    } else if (auto me = dynamic_cast<const metal *>(mat.get());
+               me && me->constant_albedo(albedo)) {
+      m.type = chunk_metal;
+      m.param = static_cast<float>(me->fuzziness());
+    } else if (auto d = dynamic_cast<const dielectric *>(mat.get())) {
+      m.type = chunk_dielectric;
+      m.param = static_cast<float>(d->refraction_index());
+    } else {
+      auto found = palette.find(mat.get());
+      if (found == palette.end()) {
+        m.palette = static_cast<uint32_t>(materials.size());
+        palette[mat.get()] = m.palette;
+        materials.push_back(mat);
+      } else {
+        m.palette = found->second;
+      }
+      return m;
+    }
+
+    for (int a = 0; a < 3; ++a)
+      m.albedo[a] = static_cast<float>(albedo[a]);
+    return m;
+  }
+
+  template <typename F> void for_each_bin(const bin_region &r, F f) const {
+    for (int k = r.lo[2]; k < r.hi[2]; ++k)
+      for (int j = r.lo[1]; j < r.hi[1]; ++j)
+        for (int i = r.lo[0]; i < r.hi[0]; ++i)
+          f((static_cast<size_t>(k) * ny + j) * nx + i);
+  }
+
+  uint64_t region_count(const bin_region &r) const {
+    uint64_t count = 0;
+    for_each_bin(r, [&](size_t b) { count += bin_counts[b]; });
+    return count;
+  }
+
+  void partition(const bin_region &r, std::vector<bin_region> &regions) const {
+    // Splits the bin grid kd-tree style, at the sphere count median of the
+    // axis with the most bins, until each region fits target_chunk_bytes
+    uint64_t count = region_count(r);
+    if (count == 0)
+      return;
+
+    int axis = 0;
+    for (int a = 1; a < 3; ++a)
+      if (r.hi[a] - r.lo[a] > r.hi[axis] - r.lo[axis])
+        axis = a;
+
+    if (count * sizeof(chunk_sphere) <= target_chunk_bytes ||
+        r.hi[axis] - r.lo[axis] < 2) {
+      regions.push_back(r);
+      return;
+    }
+
+    int split = r.lo[axis] + 1;
+    uint64_t below = 0;
+    for (; split < r.hi[axis] - 1; ++split) {
+      bin_region slab = r;
+      slab.lo[axis] = split - 1;
+      slab.hi[axis] = split;
+      below += region_count(slab);
+      if (2 * below >= count)
+        break;
+    }
+
+    bin_region left = r, right = r;
+    left.hi[axis] = split;
+    right.lo[axis] = split;
+    partition(left, regions);
+    partition(right, regions);
+  }
+
+  static uint64_t align(uint64_t offset) {
+    return (offset + chunked_scene_alignment - 1) / chunked_scene_alignment *
+           chunked_scene_alignment;
+  }
+
+  size_t bin_index(const chunk_sphere &s) const {
+    // Computed from the stored float center, so a record lands in the same
+    // bin whenever it is binned
+    int cell[3];
+    int dims[3] = {nx, ny, nz};
+    for (int a = 0; a < 3; ++a) {
+      const auto &range = grid.axis(a);
+      double f = (s.center[a] - range.min) / (range.max - range.min);
+      cell[a] = std::clamp(static_cast<int>(f * dims[a]), 0, dims[a] - 1);
+    }
+    return (static_cast<size_t>(cell[2]) * ny + cell[1]) * nx + cell[0];
+  }
+
+  void flush() {
+    // Appends the buffered records to the spill file
+    if (pending.empty())
+      return;
+    auto mode = std::ios::binary | (spilled ? std::ios::app : std::ios::trunc);
+    std::ofstream out(spill_path(), mode);
+    out.write(reinterpret_cast<const char *>(pending.data()),
+              pending.size() * sizeof(chunk_sphere));
+    if (!out)
+      throw std::runtime_error("cannot write " + spill_path());
+    spilled = true;
+    pending.clear();
+  }
+
+  void sort_spill(const std::vector<uint64_t> &first, std::fstream &sorted) {
+    // Distributes the spill file into a second file ordered by chunk, where
+    // chunk c occupies records [first[c], first[c + 1]). Half the buffer
+    // reads the spill, the other half collects records per chunk until they
+    // are written out at each chunk's cursor.
+    {
+      std::ofstream create(sorted_path(), std::ios::binary | std::ios::trunc);
+      if (!create)
+        throw std::runtime_error("cannot write " + sorted_path());
+    }
+    sorted.open(sorted_path(), std::ios::binary | std::ios::in | std::ios::out);
+
+    size_t half = max_buffered_bytes / 2 / sizeof(chunk_sphere);
+    std::vector<uint64_t> cursor(first.begin(), first.end() - 1);
+    std::vector<std::vector<chunk_sphere>> buckets(cursor.size());
+    size_t bucketed = 0;
+    auto write_buckets = [&]() {
+      for (size_t c = 0; c < buckets.size(); ++c) {
+        if (buckets[c].empty())
+          continue;
+        sorted.seekp(cursor[c] * sizeof(chunk_sphere));
+        sorted.write(reinterpret_cast<const char *>(buckets[c].data()),
+                     buckets[c].size() * sizeof(chunk_sphere));
+        cursor[c] += buckets[c].size();
+        std::vector<chunk_sphere>().swap(buckets[c]);
+      }
+      bucketed = 0;
+    };
+
+    pending.resize(half);
+    std::ifstream in(spill_path(), std::ios::binary);
+    while (in) {
+      in.read(reinterpret_cast<char *>(pending.data()),
+              half * sizeof(chunk_sphere));
+      size_t read = static_cast<size_t>(in.gcount()) / sizeof(chunk_sphere);
+      for (size_t i = 0; i < read; ++i) {
+        buckets[bin_counts[bin_index(pending[i])]].push_back(pending[i]);
+        if (++bucketed >= half)
+          write_buckets();
+      }
+    }
+    write_buckets();
+    std::vector<chunk_sphere>().swap(pending);
+    in.close();
+    std::remove(spill_path().c_str());
+    if (!sorted)
+      throw std::runtime_error("cannot write " + sorted_path());
+  }
+
+  static void sphere_bounds(const chunk_sphere &s, float bmin[3],
+                            float bmax[3]) {
+    // Rounded outward so float storage never clips a sphere
+    for (int a = 0; a < 3; ++a) {
+      bmin[a] = std::nextafter(s.center[a] - s.radius, -HUGE_VALF);
+      bmax[a] = std::nextafter(s.center[a] + s.radius, HUGE_VALF);
+    }
+  }
+
+  static uint32_t build(std::vector<chunk_node> &nodes,
+                        std::vector<chunk_sphere> &spheres, uint32_t begin,
+                        uint32_t end) {
+    // Median split along the widest axis of the sphere centers
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({});
+
+    chunk_node node = {{HUGE_VALF, HUGE_VALF, HUGE_VALF},
+                       {-HUGE_VALF, -HUGE_VALF, -HUGE_VALF},
+                       begin,
+                       end - begin};
+    float cmin[3] = {HUGE_VALF, HUGE_VALF, HUGE_VALF};
+    float cmax[3] = {-HUGE_VALF, -HUGE_VALF, -HUGE_VALF};
+    for (uint32_t i = begin; i < end; ++i) {
+      float smin[3], smax[3];
+      sphere_bounds(spheres[i], smin, smax);
+      for (int a = 0; a < 3; ++a) {
+        node.bmin[a] = std::min(node.bmin[a], smin[a]);
+        node.bmax[a] = std::max(node.bmax[a], smax[a]);
+        cmin[a] = std::min(cmin[a], spheres[i].center[a]);
+        cmax[a] = std::max(cmax[a], spheres[i].center[a]);
+      }
+    }
+
+    if (end - begin > 4) {
+      int axis = 0;
+      for (int a = 1; a < 3; ++a)
+        if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+          axis = a;
+
+      uint32_t mid = begin + (end - begin) / 2;
+      std::nth_element(spheres.begin() + begin, spheres.begin() + mid,
+                       spheres.begin() + end,
+                       [axis](const chunk_sphere &a, const chunk_sphere &b) {
+                         return a.center[axis] < b.center[axis];
+                       });
+
+      build(nodes, spheres, begin, mid);
+      node.first = build(nodes, spheres, mid, end);
+      node.count = 0;
+    }
+
+    nodes[index] = node;
+    return index;
+  }
+};
+
+inline void camera::render(chunked_scene &world) {
+  // Breadth-first version of render for scenes that live on disk. Paths are
+  // traced in batches, one bounce at a time, so that every ray of a bounce
+  // is intersected together and each scene chunk is paged in once per
+  // bounce rather than once per ray.
+  init();
+
+  struct path_state {
+    size_t pixel;
+    color throughput;
+    double cone_width;
+  };
+
+  // Size batches so the image plus every per-path structure fits in
+  // ray_memory_bytes
+  size_t pixel_count = static_cast<size_t>(image_width) * image_height;
+  size_t path_count = pixel_count * samples_per_pixel;
+  size_t image_bytes = pixel_count * sizeof(color);
+  size_t path_bytes = sizeof(path_state) + sizeof(chunked_scene::query);
+  size_t batch_size = ray_memory_bytes > image_bytes
+                          ? (ray_memory_bytes - image_bytes) / path_bytes
+                          : 0;
+  batch_size = std::max<size_t>(std::min(batch_size, path_count), 1);
+  size_t batch_count = (path_count + batch_size - 1) / batch_size;
+
+  std::vector<color> pixels(pixel_count);
+  std::vector<path_state> paths;
+  std::vector<chunked_scene::query> queries;
+  paths.reserve(batch_size);
+  queries.reserve(batch_size);
+
+  for (size_t batch = 0; batch < batch_count; ++batch) {
+    std::clog << "\rBatches remaining: " << (batch_count - batch) << ' '
+              << std::flush;
+
+    // Consecutive samples of the same pixel share a batch for coherence
+    size_t first = batch * batch_size;
+    size_t last = std::min(first + batch_size, path_count);
+    paths.clear();
+    queries.clear();
+    for (size_t k = first; k < last; ++k) {
+      size_t pixel = k / samples_per_pixel;
+      int x = static_cast<int>(pixel % image_width);
+      int y = static_cast<int>(pixel / image_width);
+      paths.push_back({pixel, color(1, 1, 1), 0});
+      queries.push_back({get_ray(x, y), hit_record(), chunk_material(), false});
+    }
+
+    for (int depth = max_depth; depth > 0 && !paths.empty(); --depth) {
+      world.intersect(queries);
+
+      // Shade every hit and compact the surviving paths to the front
+      size_t alive = 0;
+      for (size_t i = 0; i < paths.size(); ++i) {
+        auto &q = queries[i];
+        if (!q.hit) {
+          pixels[paths[i].pixel] += paths[i].throughput * background(q.r);
+          continue;
+        }
+
+        q.rec.footprint = paths[i].cone_width +
+                          pixel_spread_angle * q.rec.t * q.r.direction().length();
+        ray scattered;
+        color attenuation;
+        if (!world.scatter(q, attenuation, scattered))
+          continue;
+
+        paths[alive] = {paths[i].pixel, paths[i].throughput * attenuation,
+                        q.rec.footprint};
+        queries[alive].r = scattered;
+        ++alive;
+      }
+      paths.resize(alive);
+      queries.resize(alive);
+    }
+  }
+
+  std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+  for (const auto &pixel_color : pixels)
+    write_color(std::cout, pixel_color, samples_per_pixel);
+
+  std::clog << "\rDone.                   \n";
+}
+
+#endif
@@ -13,7 +13,8 @@ inline double linear_to_gamma(double linear_component) {
   return sqrt(linear_component);
 }
 
-void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
+inline void color_to_rgb(color pixel_color, int samples_per_pixel,
+                         int rgb[3]) {
   auto r = pixel_color.x();
   auto g = pixel_color.y();
   auto b = pixel_color.z();
@@ -29,11 +30,18 @@ void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
   g = linear_to_gamma(g);
   b = linear_to_gamma(b);
 
-  // write the newly translated color values for each component
+  // translate the color values into the [0,255] byte range
   static const interval intensity(0.000, 0.999);
-  out << static_cast<int>(256 * intensity.clamp(r)) << ' '
-      << static_cast<int>(256 * intensity.clamp(g)) << ' '
-      << static_cast<int>(256 * intensity.clamp(b)) << '\n';
+  rgb[0] = static_cast<int>(256 * intensity.clamp(r));
+  rgb[1] = static_cast<int>(256 * intensity.clamp(g));
+  rgb[2] = static_cast<int>(256 * intensity.clamp(b));
+}
+
+void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
+  // write the newly translated color values for each component
+  int rgb[3];
+  color_to_rgb(pixel_color, samples_per_pixel, rgb);
+  out << rgb[0] << ' ' << rgb[1] << ' ' << rgb[2] << '\n';
 }
 
 #endif
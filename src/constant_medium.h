@@ -0,0 +1,71 @@
+#ifndef CONSTANT_MEDIUM_H
+#define CONSTANT_MEDIUM_H
+
+#include "commonheader.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+
+class constant_medium : public hittable {
+public:
+  // Homogeneous volume filling the inside of a closed boundary. Its majorant
+  // equals its density, so delta tracking accepts every tentative collision
+  // and reduces to sampling a single exponential free-flight distance.
+  constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
+      : boundary(b), neg_inv_density(-1 / d),
+        phase_function(make_shared<isotropic>(a)) {}
+
+  constant_medium(shared_ptr<hittable> b, double d, color c)
+      : boundary(b), neg_inv_density(-1 / d),
+        phase_function(make_shared<isotropic>(c)) {}
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    hit_record rec1, rec2;
+
+    // Find where the ray enters and leaves the boundary, even if it starts
+    // inside
+    if (!boundary->hit(r, interval(-infinity, infinity), rec1))
+      return false;
+
+    if (!boundary->hit(r, interval(rec1.t + 0.0001, infinity), rec2))
+      return false;
+
+    if (rec1.t < ray_t.min)
+      rec1.t = ray_t.min;
+    if (rec2.t > ray_t.max)
+      rec2.t = ray_t.max;
+
+    if (rec1.t >= rec2.t)
+      return false;
+
+    if (rec1.t < 0)
+      rec1.t = 0;
+
+    auto ray_length = r.direction().length();
+    auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+    auto hit_distance = neg_inv_density * log(1 - random_double());
+
+    if (hit_distance > distance_inside_boundary)
+      return false;
+
+    rec.t = rec1.t + hit_distance / ray_length;
+    rec.p = r.at(rec.t);
+
+    rec.normal = vec3(1, 0, 0); // arbitrary
+    rec.front_face = true;      // also arbitrary
+    rec.u = 0;
+    rec.v = 0;
+    rec.uv_density = 0;
+    rec.mat = phase_function;
+
+    return true;
+  }
+
+private:
+  shared_ptr<hittable> boundary;
+  double neg_inv_density;
+  shared_ptr<material> phase_function;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include "commonheader.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class voxel_grid {
+public:
+  // Dense grid of densities over an axis aligned box, x varying fastest.
+  //
+  // Text file formats:
+  //   dense nx ny nz
+  //   xmin ymin zmin xmax ymax zmax
+  //   nx*ny*nz densities
+  // or
+  //   sparse nx ny nz
+  //   xmin ymin zmin xmax ymax zmax
+  //   i j k density   (one line per non-empty voxel, others are zero)
+  int nx, ny, nz;
+  aabb bounds;
+  std::vector<float> density;
+
+  voxel_grid(int _nx, int _ny, int _nz, const aabb &_bounds)
+      : nx(_nx), ny(_ny), nz(_nz), bounds(_bounds),
+        density(static_cast<size_t>(_nx) * _ny * _nz, 0.0f) {}
+
+  float &at(int i, int j, int k) {
+    return density[(static_cast<size_t>(k) * ny + j) * nx + i];
+  }
+
+  float at(int i, int j, int k) const {
+    return density[(static_cast<size_t>(k) * ny + j) * nx + i];
+  }
+
+  static voxel_grid load(const std::string &path) {
+    std::ifstream in(path);
+    std::string format;
+    int nx = 0, ny = 0, nz = 0;
+    double lo[3], hi[3];
+    in >> format >> nx >> ny >> nz;
+    in >> lo[0] >> lo[1] >> lo[2] >> hi[0] >> hi[1] >> hi[2];
+    if (!in || (format != "dense" && format != "sparse") || nx <= 0 ||
+        ny <= 0 || nz <= 0)
+      throw std::runtime_error("unsupported voxel file " + path);
+
+    voxel_grid grid(nx, ny, nz,
+                    aabb(point3(lo[0], lo[1], lo[2]), point3(hi[0], hi[1], hi[2])));
+    if (format == "dense") {
+      for (auto &d : grid.density)
+        in >> d;
+      if (!in)
+        throw std::runtime_error("truncated voxel file " + path);
+    } else {
+      int i, j, k;
+      float d;
+      while (in >> i >> j >> k >> d) {
+        if (i < 0 || i >= nx || j < 0 || j >= ny || k < 0 || k >= nz)
+          throw std::runtime_error("voxel out of range in " + path);
+        grid.at(i, j, k) = d;
+      }
+    }
+    return grid;
+  }
+};
+
+class grid_medium : public hittable {
+public:
+  // Heterogeneous volume sampled with delta tracking. Tracking steps through
+  // a coarse grid of per-block majorants (the densest voxel in each block of
+  // block_size^3 voxels) instead of one global bound, so thin regions take
+  // long steps and empty blocks are skipped without sampling at all.
+  grid_medium(shared_ptr<const voxel_grid> _grid, double density_scale,
+              const color &albedo, int block_size = 8)
+      : grid(_grid), scale(density_scale), block(block_size),
+        phase_function(make_shared<isotropic>(albedo)) {
+    dims[0] = grid->nx;
+    dims[1] = grid->ny;
+    dims[2] = grid->nz;
+    for (int a = 0; a < 3; ++a) {
+      const auto &range = grid->bounds.axis(a);
+      voxel_size[a] = (range.max - range.min) / dims[a];
+      blocks[a] = (dims[a] + block - 1) / block;
+    }
+
+    majorant.assign(static_cast<size_t>(blocks[0]) * blocks[1] * blocks[2], 0);
+    for (int k = 0; k < dims[2]; ++k)
+      for (int j = 0; j < dims[1]; ++j)
+        for (int i = 0; i < dims[0]; ++i) {
+          auto &m = majorant[block_index(i / block, j / block, k / block)];
+          m = std::max(m, scale * grid->at(i, j, k));
+        }
+  }
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    interval t = ray_t;
+    if (!grid->bounds.hit(r, t))
+      return false;
+
+    // Set up a 3D DDA over the majorant blocks, starting where the ray enters
+    point3 entry = r.at(t.min);
+    int cell[3], step[3];
+    double t_next[3];
+    for (int a = 0; a < 3; ++a) {
+      int voxel = static_cast<int>(
+          std::floor((entry[a] - grid->bounds.axis(a).min) / voxel_size[a]));
+      cell[a] = std::clamp(voxel, 0, dims[a] - 1) / block;
+      step[a] = r.direction()[a] > 0 ? 1 : -1;
+      t_next[a] = boundary_t(r, a, cell[a] + (step[a] > 0 ? 1 : 0));
+    }
+
+    auto ray_length = r.direction().length();
+    double t_cur = t.min;
+    while (true) {
+      int axis = 0;
+      if (t_next[1] < t_next[axis])
+        axis = 1;
+      if (t_next[2] < t_next[axis])
+        axis = 2;
+      double t_exit = std::fmin(t_next[axis], t.max);
+
+      double m = majorant[block_index(cell[0], cell[1], cell[2])];
+      if (m > 0) {
+        // Tentative collisions at majorant rate m; each is real with
+        // probability density / m, otherwise it is a null collision and
+        // tracking continues. Free flight is memoryless, so restarting at the
+        // next block boundary with that block's majorant is unbiased.
+        double tt = t_cur;
+        while (true) {
+          tt -= log(1 - random_double()) / (m * ray_length);
+          if (tt >= t_exit)
+            break;
+          point3 p = r.at(tt);
+          if (random_double() * m < density(p)) {
+            rec.t = tt;
+            rec.p = p;
+            rec.normal = vec3(1, 0, 0); // arbitrary
+            rec.front_face = true;      // also arbitrary
+            rec.u = 0;
+            rec.v = 0;
+            rec.uv_density = 0;
+            rec.mat = phase_function;
+            return true;
+          }
+        }
+      }
+
+      if (t_exit >= t.max)
+        return false;
+
+      t_cur = t_exit;
+      cell[axis] += step[axis];
+      if (cell[axis] < 0 || cell[axis] >= blocks[axis])
+        return false;
+      t_next[axis] = boundary_t(r, axis, cell[axis] + (step[axis] > 0 ? 1 : 0));
+    }
+  }
+
+private:
+  shared_ptr<const voxel_grid> grid;
+  double scale;
+  int block;
+  int dims[3];
+  int blocks[3];
+  double voxel_size[3];
+  std::vector<double> majorant;
+  shared_ptr<material> phase_function;
+
+  size_t block_index(int i, int j, int k) const {
+    return (static_cast<size_t>(k) * blocks[1] + j) * blocks[0] + i;
+  }
+
+  double boundary_t(const ray &r, int axis, int boundary) const {
+    // Ray parameter where it crosses the given block boundary plane
+    if (r.direction()[axis] == 0)
+      return infinity;
+    int voxel = std::min(boundary * block, dims[axis]);
+    double plane = grid->bounds.axis(axis).min + voxel * voxel_size[axis];
+    return (plane - r.origin()[axis]) / r.direction()[axis];
+  }
+
+  double density(const point3 &p) const {
+    // Nearest voxel lookup, which keeps the block majorants exact
+    int index[3];
+    for (int a = 0; a < 3; ++a) {
+      int voxel = static_cast<int>(
+          std::floor((p[a] - grid->bounds.axis(a).min) / voxel_size[a]));
+      index[a] = std::clamp(voxel, 0, dims[a] - 1);
+    }
+    return scale * grid->at(index[0], index[1], index[2]);
+  }
+};
+
+#endif
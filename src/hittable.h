@@ -11,6 +11,10 @@ public:
   vec3 normal;
   shared_ptr<material> mat;
   double t;
+  double u; // Surface texture coordinates
+  double v;
+  double uv_density = 0; // Texture coordinate change per unit of surface length
+  double footprint = 0;  // Pixel footprint width at p in world units
   bool front_face;
 
   void set_face_normal(const ray &r, const vec3 &outward_normal) {
@@ -3,7 +3,8 @@
 
 #include "commonheader.h"
 
-class hit_record;
+#include "hittable.h"
+#include "texture.h"
 
 class material {
 public:
@@ -16,6 +17,13 @@ public:
 class lambertian : public material {
 public:
   lambertian(const color &a) : albedo(a) {}
+  lambertian(shared_ptr<texture> a) : tex(a) {}
+
+  bool constant_albedo(color &c) const {
+    // Reports the albedo if it doesn't come from a texture
+    c = albedo;
+    return !tex;
+  }
 
   bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
                ray &scattered) const override {
@@ -26,28 +34,41 @@ public:
       scatter_direction = rec.normal;
 
     scattered = ray(rec.p, scatter_direction);
-    attenuation = albedo;
+    attenuation = tex ? tex->value(rec.u, rec.v, rec.footprint * rec.uv_density, rec.p)
+                      : albedo;
     return true;
   }
 
 private:
-  color albedo;
+  color albedo;             // Used when there is no texture
+  shared_ptr<texture> tex;
 };
 
 class metal : public material {
 public:
   metal(const color &a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+  metal(shared_ptr<texture> a, double f) : tex(a), fuzz(f < 1 ? f : 1) {}
+
+  bool constant_albedo(color &c) const {
+    // Reports the albedo if it doesn't come from a texture
+    c = albedo;
+    return !tex;
+  }
+
+  double fuzziness() const { return fuzz; }
 
   bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
                ray &scattered) const override {
     vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
     scattered = ray(rec.p, reflected + fuzz * random_unit_vector());
-    attenuation = albedo;
+    attenuation = tex ? tex->value(rec.u, rec.v, rec.footprint * rec.uv_density, rec.p)
+                      : albedo;
     return true;
   }
 
 private:
-  color albedo;
+  color albedo;             // Used when there is no texture
+  shared_ptr<texture> tex;
   double fuzz;
 };
 
@@ -55,6 +76,8 @@ class dielectric : public material {
 public:
   dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
+  double refraction_index() const { return ir; }
+
   bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
                ray &scattered) const override {
     attenuation = color(1.0, 1.0, 1.0);
@@ -88,4 +111,22 @@ private:
   }
 };
 
+class isotropic : public material {
+public:
+  // Phase function for participating media, scattering uniformly in all
+  // directions
+  isotropic(const color &c) : albedo(make_shared<solid_color>(c)) {}
+  isotropic(shared_ptr<texture> a) : albedo(a) {}
+
+  bool scatter(const ray &r_in, const hit_record &rec, color &attenuation,
+               ray &scattered) const override {
+    scattered = ray(rec.p, random_unit_vector());
+    attenuation = albedo->value(rec.u, rec.v, rec.p);
+    return true;
+  }
+
+private:
+  shared_ptr<texture> albedo;
+};
+
 #endif // MATERIAL_H_
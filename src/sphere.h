@@ -11,6 +11,17 @@ public:
       : center(_center), radius(_radius), mat(_material) {}
 
   bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+    if (!hit_sphere(center, radius, r, ray_t, rec))
+      return false;
+
+    rec.mat = mat;
+    return true;
+  }
+
+  static bool hit_sphere(const point3 &center, double radius, const ray &r,
+                         interval ray_t, hit_record &rec) {
+    // Fills in everything but the material, so that callers storing spheres
+    // in their own compact form can share the intersection code
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -33,7 +44,8 @@ public:
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat = mat;
+    get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.uv_density = 1.0 / (2 * pi * radius);
 
     return true;
   }
@@ -42,6 +54,17 @@ private:
   point3 center;
   double radius;
   shared_ptr<material> mat;
+
+  static void get_sphere_uv(const point3 &p, double &u, double &v) {
+    // p: a given point on the sphere of radius one, centered at the origin.
+    // u: returned value [0,1] of angle around the Y axis from X=-1.
+    // v: returned value [0,1] of angle from Y=-1 to Y=+1.
+    auto theta = acos(-p.y());
+    auto phi = atan2(-p.z(), p.x()) + pi;
+
+    u = phi / (2 * pi);
+    v = theta / pi;
+  }
 };
 
 #endif
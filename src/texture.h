@@ -0,0 +1,89 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "commonheader.h"
+
+#include "color.h"
+#include "texture_cache.h"
+
+#include <cmath>
+#include <string>
+
+class texture {
+public:
+  virtual ~texture() = default;
+
+  virtual color value(double u, double v, const point3 &p) const = 0;
+
+  // footprint is the width of the shading point's pixel footprint in texture
+  // (u,v) space. Textures that are prefiltered override this to pick a level.
+  virtual color value(double u, double v, double footprint,
+                      const point3 &p) const {
+    return value(u, v, p);
+  }
+};
+
+class solid_color : public texture {
+public:
+  solid_color(const color &c) : color_value(c) {}
+
+  solid_color(double red, double green, double blue)
+      : solid_color(color(red, green, blue)) {}
+
+  color value(double u, double v, const point3 &p) const override {
+    return color_value;
+  }
+
+private:
+  color color_value;
+};
+
+class image_texture : public texture {
+public:
+  // Samples a tiled, mip-mapped texture file through a shared tile cache
+  image_texture(shared_ptr<texture_cache> _cache, const std::string &path)
+      : cache(_cache), handle(_cache->open(path)) {}
+
+  color value(double u, double v, const point3 &p) const override {
+    return value(u, v, 0.0, p);
+  }
+
+  color value(double u, double v, double footprint,
+              const point3 &p) const override {
+    const auto &header = cache->header(handle);
+    int last_level = static_cast<int>(header.levels.size()) - 1;
+
+    // Pick a mip level from the footprint measured in finest-level texels.
+    // Choosing between the two nearest levels at random blends them across
+    // pixel samples, which averages out to trilinear filtering.
+    double lod = std::log2(std::fmax(footprint * header.width, 1.0));
+    int level = static_cast<int>(lod);
+    if (random_double() < lod - level)
+      ++level;
+    if (level > last_level)
+      level = last_level;
+
+    // Clamp input texture coordinates to [0,1] x [1,0]
+    static const interval unit(0, 1);
+    u = unit.clamp(u);
+    v = 1.0 - unit.clamp(v); // Flip V to image coordinates
+
+    const auto &l = header.levels[level];
+    int x = std::min(static_cast<int>(u * l.width), static_cast<int>(l.width) - 1);
+    int y = std::min(static_cast<int>(v * l.height), static_cast<int>(l.height) - 1);
+
+    int tile_size = static_cast<int>(header.tile_size);
+    auto tile = cache->tile(handle, level, x / tile_size, y / tile_size);
+    const unsigned char *texel =
+        tile->data() + ((y % tile_size) * tile_size + (x % tile_size)) * 3;
+
+    using tiled_texture_detail::decode;
+    return color(decode(texel[0]), decode(texel[1]), decode(texel[2]));
+  }
+
+private:
+  shared_ptr<texture_cache> cache;
+  int handle;
+};
+
+#endif
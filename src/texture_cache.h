@@ -0,0 +1,191 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "tiled_texture.h"
+
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Packed 8-bit RGB texels of a single tile
+using texture_tile = std::vector<unsigned char>;
+
+struct texture_cache_stats {
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t bytes_loaded = 0;
+  size_t resident_bytes = 0;
+  size_t peak_resident_bytes = 0;
+
+  double hit_rate() const {
+    return lookups == 0 ? 0.0 : static_cast<double>(hits) / lookups;
+  }
+};
+
+class texture_cache {
+public:
+  // Tiles are loaded lazily from tiled texture files and kept in memory until
+  // the total resident size would exceed max_bytes, at which point the least
+  // recently used tiles are evicted. Safe to share between render threads.
+  explicit texture_cache(size_t max_bytes = 256 * 1024 * 1024)
+      : capacity(max_bytes) {}
+
+  texture_cache(const texture_cache &) = delete;
+  texture_cache &operator=(const texture_cache &) = delete;
+
+  int open(const std::string &path) {
+    // Registers a tiled texture file and returns its handle. Only the header
+    // is read here; tile data is fetched on first use.
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto file = std::make_unique<texture_file>();
+    file->stream.open(path, std::ios::binary);
+    if (!file->stream)
+      throw std::runtime_error("cannot open tiled texture " + path);
+    file->header = read_tiled_texture_header(file->stream);
+
+    files.push_back(std::move(file));
+    return static_cast<int>(files.size() - 1);
+  }
+
+  const tiled_texture_header &header(int handle) const {
+    // Headers are immutable once opened, and each file lives in its own
+    // allocation, so the reference stays valid after further open() calls
+    std::lock_guard<std::mutex> lock(mutex);
+    return files[handle]->header;
+  }
+
+  std::shared_ptr<const texture_tile> tile(int handle, int level, int tx, int ty) {
+    // Returns the requested tile, loading it from disk on a miss. The caller
+    // holds its own reference, so a tile evicted while in use stays valid.
+    // The disk read happens outside the cache lock; other threads asking for
+    // the same tile meanwhile wait for that read instead of repeating it.
+    uint64_t key = make_key(handle, level, tx, ty);
+    std::unique_lock<std::mutex> lock(mutex);
+    ++stats.lookups;
+
+    auto found = entries.find(key);
+    if (found != entries.end()) {
+      ++stats.hits;
+      lru.splice(lru.begin(), lru, found->second);
+      return found->second->data;
+    }
+
+    auto in_flight = loading.find(key);
+    if (in_flight != loading.end()) {
+      ++stats.hits;
+      auto pending = in_flight->second;
+      lock.unlock();
+      return pending.get();
+    }
+
+    ++stats.misses;
+    std::promise<std::shared_ptr<const texture_tile>> promise;
+    loading[key] = promise.get_future().share();
+    auto &file = *files[handle];
+    lock.unlock();
+
+    std::shared_ptr<texture_tile> data;
+    try {
+      data = std::make_shared<texture_tile>(file.header.tile_bytes());
+      std::lock_guard<std::mutex> file_lock(file.mutex);
+      file.stream.clear();
+      file.stream.seekg(file.header.tile_offset(level, tx, ty));
+      file.stream.read(reinterpret_cast<char *>(data->data()), data->size());
+      if (!file.stream)
+        throw std::runtime_error("failed reading texture tile");
+    } catch (...) {
+      lock.lock();
+      loading.erase(key);
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+
+    lock.lock();
+    stats.bytes_loaded += data->size();
+    stats.resident_bytes += data->size();
+    lru.push_front({key, data});
+    entries[key] = lru.begin();
+    evict_to_capacity();
+    stats.peak_resident_bytes =
+        std::max(stats.peak_resident_bytes, stats.resident_bytes);
+    loading.erase(key);
+    promise.set_value(data);
+
+    return data;
+  }
+
+  void set_capacity(size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = max_bytes;
+    evict_to_capacity();
+  }
+
+  texture_cache_stats statistics() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+  void print_stats(std::ostream &out) const {
+    auto s = statistics();
+    out << "Texture cache: " << s.lookups << " lookups, " << s.hits
+        << " hits (" << 100.0 * s.hit_rate() << "%), " << s.misses
+        << " misses, " << s.evictions << " evictions\n"
+        << "               " << s.bytes_loaded / 1024 << " KiB loaded, "
+        << s.peak_resident_bytes / 1024 << " KiB peak resident of "
+        << capacity / 1024 << " KiB cap\n";
+  }
+
+private:
+  struct texture_file {
+    std::mutex mutex; // Guards the stream position during a tile read
+    std::ifstream stream;
+    tiled_texture_header header;
+  };
+
+  struct entry {
+    uint64_t key;
+    std::shared_ptr<const texture_tile> data;
+  };
+
+  mutable std::mutex mutex;
+  size_t capacity;
+  std::vector<std::unique_ptr<texture_file>> files;
+  std::list<entry> lru; // Most recently used at the front
+  std::unordered_map<uint64_t, std::list<entry>::iterator> entries;
+  // Tiles being read from disk, for threads that ask for them meanwhile
+  std::unordered_map<uint64_t,
+                     std::shared_future<std::shared_ptr<const texture_tile>>>
+      loading;
+  texture_cache_stats stats;
+
+  static uint64_t make_key(int handle, int level, int tx, int ty) {
+    // 16 bits of file handle, 6 bits of level, 21 bits per tile coordinate
+    return (static_cast<uint64_t>(handle) << 48) |
+           (static_cast<uint64_t>(level) << 42) |
+           (static_cast<uint64_t>(ty) << 21) | static_cast<uint64_t>(tx);
+  }
+
+  void evict_to_capacity() {
+    // Always keep the most recent tile, even if it alone exceeds the cap
+    while (stats.resident_bytes > capacity && lru.size() > 1) {
+      auto &victim = lru.back();
+      stats.resident_bytes -= victim.data->size();
+      ++stats.evictions;
+      entries.erase(victim.key);
+      lru.pop_back();
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef TILED_TEXTURE_H
+#define TILED_TEXTURE_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// On-disk layout of a tiled, mip-mapped texture (.rtx)
+//
+//   "RTXT" | version | width | height | tile_size | level_count
+//   level_count x { width | height | tiles_x | tiles_y | data_offset }
+//   tile data
+//
+// Every level is split into square tiles of tile_size x tile_size RGB texels
+// (8 bits per channel, stored as read from the source image). Tiles are
+// written row-major within a level and levels are written from finest (0) to
+// coarsest (1x1). Tiles on the right/bottom edge are padded by repeating the
+// last texel so that every tile has the same byte size, which lets a reader
+// seek straight to any tile without an index.
+
+const uint32_t tiled_texture_magic = 0x54585452; // "RTXT" little endian
+const uint32_t tiled_texture_version = 1;
+
+struct tiled_texture_level {
+  uint32_t width;
+  uint32_t height;
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+  uint64_t data_offset; // Byte offset of the first tile of this level
+};
+
+struct tiled_texture_header {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t tile_size = 0;
+  std::vector<tiled_texture_level> levels;
+
+  size_t tile_bytes() const {
+    return static_cast<size_t>(tile_size) * tile_size * 3;
+  }
+
+  uint64_t tile_offset(int level, int tx, int ty) const {
+    const auto &l = levels[level];
+    return l.data_offset +
+           (static_cast<uint64_t>(ty) * l.tiles_x + tx) * tile_bytes();
+  }
+};
+
+namespace tiled_texture_detail {
+
+template <typename T> void write_pod(std::ostream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> void read_pod(std::istream &in, T &value) {
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+inline int skip_ppm_space(std::istream &in) {
+  // Skip whitespace and '#' comments between PPM header tokens
+  int c = in.get();
+  while (in && (isspace(c) || c == '#')) {
+    if (c == '#') {
+      while (in && c != '\n')
+        c = in.get();
+    }
+    c = in.get();
+  }
+  in.unget();
+  return c;
+}
+
+// Texels use the same gamma 2 encoding write_color outputs
+inline double decode(unsigned char c) {
+  double g = c / 255.0;
+  return g * g;
+}
+
+inline unsigned char encode(double linear) {
+  return static_cast<unsigned char>(std::sqrt(linear) * 255.0 + 0.5);
+}
+
+} // namespace tiled_texture_detail
+
+inline tiled_texture_header read_tiled_texture_header(std::istream &in) {
+  using tiled_texture_detail::read_pod;
+
+  uint32_t magic = 0, version = 0, level_count = 0;
+  tiled_texture_header header;
+  read_pod(in, magic);
+  read_pod(in, version);
+  if (!in || magic != tiled_texture_magic || version != tiled_texture_version)
+    throw std::runtime_error("not a tiled texture file");
+
+  read_pod(in, header.width);
+  read_pod(in, header.height);
+  read_pod(in, header.tile_size);
+  read_pod(in, level_count);
+
+  header.levels.resize(level_count);
+  for (auto &level : header.levels) {
+    read_pod(in, level.width);
+    read_pod(in, level.height);
+    read_pod(in, level.tiles_x);
+    read_pod(in, level.tiles_y);
+    read_pod(in, level.data_offset);
+  }
+
+  if (!in || header.tile_size == 0 || level_count == 0)
+    throw std::runtime_error("corrupt tiled texture header");
+  return header;
+}
+
+inline std::vector<unsigned char> load_ppm(const std::string &path, int &width,
+                                           int &height) {
+  // Reads a binary (P6) or ASCII (P3) PPM image into packed 8-bit RGB
+  using tiled_texture_detail::skip_ppm_space;
+
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("cannot open image " + path);
+
+  std::string format;
+  int max_value = 0;
+  in >> format;
+  skip_ppm_space(in);
+  in >> width;
+  skip_ppm_space(in);
+  in >> height;
+  skip_ppm_space(in);
+  in >> max_value;
+  if (!in || (format != "P3" && format != "P6") || width <= 0 || height <= 0 ||
+      max_value <= 0 || max_value > 255)
+    throw std::runtime_error("unsupported PPM image " + path);
+
+  std::vector<unsigned char> pixels(static_cast<size_t>(width) * height * 3);
+  if (format == "P6") {
+    in.get(); // Single whitespace after max value
+    in.read(reinterpret_cast<char *>(pixels.data()), pixels.size());
+    if (max_value != 255)
+      for (auto &channel : pixels)
+        channel = static_cast<unsigned char>(
+            std::min(channel * 255 / max_value, 255));
+  } else {
+    for (auto &channel : pixels) {
+      int value;
+      in >> value;
+      channel = static_cast<unsigned char>(value * 255 / max_value);
+    }
+  }
+
+  if (!in)
+    throw std::runtime_error("truncated PPM image " + path);
+  return pixels;
+}
+
+inline void write_tiled_texture(const std::string &path,
+                                std::vector<unsigned char> pixels, int width,
+                                int height, int tile_size = 64) {
+  // Builds the full mip chain with a 2x2 box filter and writes it out tiled.
+  // Each level is written before the next one is built from it, so only two
+  // levels are ever held at once.
+  using tiled_texture_detail::decode;
+  using tiled_texture_detail::encode;
+  using tiled_texture_detail::write_pod;
+
+  std::vector<tiled_texture_level> levels;
+  uint32_t level_width = width, level_height = height;
+  while (true) {
+    tiled_texture_level level;
+    level.width = level_width;
+    level.height = level_height;
+    level.tiles_x = (level_width + tile_size - 1) / tile_size;
+    level.tiles_y = (level_height + tile_size - 1) / tile_size;
+    levels.push_back(level);
+    if (level_width == 1 && level_height == 1)
+      break;
+    level_width = level_width > 1 ? level_width / 2 : 1;
+    level_height = level_height > 1 ? level_height / 2 : 1;
+  }
+
+  // Header size is fixed once the level count is known
+  uint64_t offset = 6 * sizeof(uint32_t) +
+                    levels.size() * (4 * sizeof(uint32_t) + sizeof(uint64_t));
+  size_t tile_bytes = static_cast<size_t>(tile_size) * tile_size * 3;
+  for (auto &level : levels) {
+    level.data_offset = offset;
+    offset += static_cast<uint64_t>(level.tiles_x) * level.tiles_y * tile_bytes;
+  }
+
+  std::ofstream out(path, std::ios::binary);
+  if (!out)
+    throw std::runtime_error("cannot write tiled texture " + path);
+
+  write_pod(out, tiled_texture_magic);
+  write_pod(out, tiled_texture_version);
+  write_pod(out, static_cast<uint32_t>(width));
+  write_pod(out, static_cast<uint32_t>(height));
+  write_pod(out, static_cast<uint32_t>(tile_size));
+  write_pod(out, static_cast<uint32_t>(levels.size()));
+  for (const auto &level : levels) {
+    write_pod(out, level.width);
+    write_pod(out, level.height);
+    write_pod(out, level.tiles_x);
+    write_pod(out, level.tiles_y);
+    write_pod(out, level.data_offset);
+  }
+
+  std::vector<unsigned char> src = std::move(pixels);
+  std::vector<unsigned char> tile(tile_bytes);
+  for (size_t l = 0; l < levels.size(); ++l) {
+    const auto &level = levels[l];
+    for (uint32_t ty = 0; ty < level.tiles_y; ++ty) {
+      for (uint32_t tx = 0; tx < level.tiles_x; ++tx) {
+        for (int y = 0; y < tile_size; ++y) {
+          uint32_t sy = std::min<uint32_t>(ty * tile_size + y, level.height - 1);
+          for (int x = 0; x < tile_size; ++x) {
+            uint32_t sx =
+                std::min<uint32_t>(tx * tile_size + x, level.width - 1);
+            for (int c = 0; c < 3; ++c)
+              tile[(y * tile_size + x) * 3 + c] =
+                  src[(sy * level.width + sx) * 3 + c];
+          }
+        }
+        out.write(reinterpret_cast<const char *>(tile.data()), tile.size());
+      }
+    }
+    if (l + 1 == levels.size())
+      break;
+
+    // Downsample into the next level, clamping odd edges
+    uint32_t w = level.width, h = level.height;
+    uint32_t nw = levels[l + 1].width, nh = levels[l + 1].height;
+    std::vector<unsigned char> dst(static_cast<size_t>(nw) * nh * 3);
+    for (uint32_t y = 0; y < nh; ++y) {
+      for (uint32_t x = 0; x < nw; ++x) {
+        uint32_t x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+        uint32_t y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+        for (int c = 0; c < 3; ++c) {
+          // Texels are gamma encoded, so average in linear space
+          double sum = decode(src[(y0 * w + x0) * 3 + c]) +
+                       decode(src[(y0 * w + x1) * 3 + c]) +
+                       decode(src[(y1 * w + x0) * 3 + c]) +
+                       decode(src[(y1 * w + x1) * 3 + c]);
+          dst[(y * nw + x) * 3 + c] = encode(sum / 4);
+        }
+      }
+    }
+    src = std::move(dst);
+  }
+
+  if (!out)
+    throw std::runtime_error("failed writing tiled texture " + path);
+}
+
+inline void convert_ppm_to_tiled(const std::string &ppm_path,
+                                 const std::string &tiled_path,
+                                 int tile_size = 64) {
+  // Written under a temporary name and renamed into place, so an interrupted
+  // conversion never leaves a truncated file that looks up to date
+  int width, height;
+  auto pixels = load_ppm(ppm_path, width, height);
+  std::string temp = tiled_path + ".tmp";
+  write_tiled_texture(temp, std::move(pixels), width, height, tile_size);
+  std::error_code error;
+  std::filesystem::rename(temp, tiled_path, error);
+  if (error)
+    throw std::runtime_error("cannot replace " + tiled_path + ": " +
+                             error.message());
+}
+
+inline bool tiled_texture_is_stale(const std::string &ppm_path,
+                                   const std::string &tiled_path) {
+  // True when the tiled file is missing or older than its source image
+  std::error_code error;
+  auto tiled_time = std::filesystem::last_write_time(tiled_path, error);
+  if (error)
+    return true;
+  auto ppm_time = std::filesystem::last_write_time(ppm_path, error);
+  return !error && ppm_time > tiled_time;
+}
+
+#endif